@@ -0,0 +1,141 @@
+#ifndef GENEALOGY_EXPORT_H
+#define GENEALOGY_EXPORT_H
+
+#include <ostream>
+#include <sstream>
+#include <string>
+#include "virus_genealogy.h"
+
+// Streaming exporters. Everything is written straight to the given stream
+// while walking the genealogy, so memory use doesn't depend on its size;
+// buffering is left to the stream (e.g. a std::ofstream with a large
+// rdbuf()->pubsetbuf()).
+
+namespace genealogy_export {
+
+// Formats an id with operator<< into a buffer reused between calls.
+// String ids, the common case, are passed through without any copy.
+class IdFormatter {
+private:
+
+    std::ostringstream buffer_;
+    std::string formatted_;
+
+public:
+
+    template<class Id>
+    std::string const &format(Id const &id) {
+        buffer_.str(std::string());
+        buffer_ << id;
+        formatted_ = buffer_.str();
+        return formatted_;
+    }
+
+    std::string const &format(std::string const &id) {
+        return id;
+    }
+};
+
+inline void write_dot_id(std::ostream &out, std::string const &id) {
+    out << '"';
+    for (char c : id) {
+        if (c == '"' || c == '\\') {
+            out << '\\';
+        }
+        out << c;
+    }
+    out << '"';
+}
+
+// Backslash, tab, newline and carriage return are written as \\, \t, \n
+// and \r, so fields never contain the edge list's separators.
+inline void write_edge_list_id(std::ostream &out, std::string const &id) {
+    for (char c : id) {
+        switch (c) {
+            case '\\': out << "\\\\"; break;
+            case '\t': out << "\\t"; break;
+            case '\n': out << "\\n"; break;
+            case '\r': out << "\\r"; break;
+            default: out << c;
+        }
+    }
+}
+
+inline void write_xml_escaped(std::ostream &out, std::string const &text) {
+    for (char c : text) {
+        switch (c) {
+            case '&': out << "&amp;"; break;
+            case '<': out << "&lt;"; break;
+            case '>': out << "&gt;"; break;
+            case '"': out << "&quot;"; break;
+            case '\'': out << "&apos;"; break;
+            default: out << c;
+        }
+    }
+}
+
+// One "parent<TAB>child" line per edge, ids escaped by write_edge_list_id.
+template<class Virus>
+void write_edge_list(VirusGenealogy<Virus> const &genealogy, std::ostream &out) {
+    typedef typename Virus::id_type id_type;
+    IdFormatter formatter;
+
+    genealogy.for_each_edge(
+            [&out, &formatter](id_type const &parent_id, id_type const &child_id) {
+        write_edge_list_id(out, formatter.format(parent_id));
+        out << '\t';
+        write_edge_list_id(out, formatter.format(child_id));
+        out << '\n';
+    });
+}
+
+template<class Virus>
+void write_dot(VirusGenealogy<Virus> const &genealogy, std::ostream &out) {
+    typedef typename Virus::id_type id_type;
+    IdFormatter formatter;
+
+    out << "digraph genealogy {\n";
+    genealogy.for_each_virus([&out, &formatter](id_type const &id) {
+        out << "  ";
+        write_dot_id(out, formatter.format(id));
+        out << ";\n";
+    });
+    genealogy.for_each_edge(
+            [&out, &formatter](id_type const &parent_id, id_type const &child_id) {
+        out << "  ";
+        write_dot_id(out, formatter.format(parent_id));
+        out << " -> ";
+        write_dot_id(out, formatter.format(child_id));
+        out << ";\n";
+    });
+    out << "}\n";
+}
+
+template<class Virus>
+void write_graphml(VirusGenealogy<Virus> const &genealogy, std::ostream &out) {
+    typedef typename Virus::id_type id_type;
+    IdFormatter formatter;
+
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<graphml xmlns=\"http://graphml.graphdrawing.org/xmlns\">\n"
+        << "  <graph id=\"genealogy\" edgedefault=\"directed\">\n";
+    genealogy.for_each_virus([&out, &formatter](id_type const &id) {
+        out << "    <node id=\"";
+        write_xml_escaped(out, formatter.format(id));
+        out << "\"/>\n";
+    });
+    genealogy.for_each_edge(
+            [&out, &formatter](id_type const &parent_id, id_type const &child_id) {
+        out << "    <edge source=\"";
+        write_xml_escaped(out, formatter.format(parent_id));
+        out << "\" target=\"";
+        write_xml_escaped(out, formatter.format(child_id));
+        out << "\"/>\n";
+    });
+    out << "  </graph>\n"
+        << "</graphml>\n";
+}
+
+}
+
+#endif
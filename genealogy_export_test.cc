@@ -0,0 +1,99 @@
+#include <sstream>
+#include <string>
+#include <vector>
+#include "testing.h"
+#include "genealogy_export.h"
+#include "sample_virus.h"
+
+class ExportGenealogy : public VirusGenealogy<Virus<std::string>> {
+public:
+    ExportGenealogy() : VirusGenealogy("A") {
+        create("B", "A");
+        create("C\"<&>", "A");
+        create("BC", std::vector<std::string>{"B", "C\"<&>"});
+    }
+};
+
+class SingleVirusGenealogy : public VirusGenealogy<Virus<std::string>> {
+public:
+    SingleVirusGenealogy() : VirusGenealogy("A") {}
+};
+
+std::vector<std::string> splitLines(std::string const &text) {
+    std::vector<std::string> lines;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+void testEdgeList() {
+    beginTest();
+
+    ExportGenealogy genealogy;
+    std::ostringstream out;
+    genealogy_export::write_edge_list(genealogy, out);
+
+    std::vector<std::string> expected = {"A\tB", "A\tC\"<&>", "B\tBC",
+        "C\"<&>\tBC"};
+    checkEqual(splitLines(out.str()), expected,
+            "Wrote every edge once, ordered by parent and child id.");
+}
+
+void testDot() {
+    beginTest();
+
+    ExportGenealogy genealogy;
+    std::ostringstream out;
+    genealogy_export::write_dot(genealogy, out);
+    std::vector<std::string> lines = splitLines(out.str());
+
+    checkEqual<std::string>(lines.front(), "digraph genealogy {",
+            "Graph header written.");
+    checkEqual<std::string>(lines.back(), "}", "Graph closed.");
+
+    std::vector<std::string> body(lines.begin() + 1, lines.end() - 1);
+    std::vector<std::string> expected = {"  \"A\";", "  \"B\";",
+        "  \"BC\";", "  \"C\\\"<&>\";", "  \"A\" -> \"B\";",
+        "  \"A\" -> \"C\\\"<&>\";", "  \"B\" -> \"BC\";",
+        "  \"C\\\"<&>\" -> \"BC\";"};
+    checkSameSet(body, expected, "Nodes and edges written and quoted.");
+}
+
+void testGraphML() {
+    beginTest();
+
+    ExportGenealogy genealogy;
+    std::ostringstream out;
+    genealogy_export::write_graphml(genealogy, out);
+    std::string text = out.str();
+
+    check(text.find("<node id=\"C&quot;&lt;&amp;&gt;\"/>") != std::string::npos,
+            "Node ids are escaped.");
+    check(text.find("<edge source=\"A\" target=\"B\"/>") != std::string::npos,
+            "Edges are written.");
+    check(text.find("</graphml>") != std::string::npos, "Document closed.");
+}
+
+void testEdgeListEscaping() {
+    beginTest();
+
+    SingleVirusGenealogy genealogy;
+    genealogy.create("B\tC", "A");
+    genealogy.create("D\nE\\", "B\tC");
+    std::ostringstream out;
+    genealogy_export::write_edge_list(genealogy, out);
+
+    std::vector<std::string> expected = {"A\tB\\tC", "B\\tC\tD\\nE\\\\"};
+    checkSameSet(splitLines(out.str()), expected,
+            "Separators and backslashes in ids are escaped.");
+}
+
+int main() {
+    testEdgeList();
+    testEdgeListEscaping();
+    testDot();
+    testGraphML();
+}
@@ -1,6 +1,8 @@
 #ifndef VIRUS_GENEALOGY_H
 #define VIRUS_GENEALOGY_H
 
+#include <algorithm>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <set>
@@ -36,11 +38,24 @@ private:
 
     id_type stem_id_;
     std::map<id_type, std::shared_ptr<Node>> genealogy_;
+    bool metrics_cache_enabled_;
+    // Unique among all genealogies ever constructed, unlike the address.
+    std::size_t instance_id_;
+    // Bumped by every successful remove(), the only way nodes disappear.
+    std::size_t generation_;
+
+    // Starts at 1; handles use 0 for "no genealogy".
+    static std::size_t next_instance_id() {
+        static std::atomic<std::size_t> counter(0);
+        return ++counter;
+    }
 
-    void throw_if_not_found(id_type const &id) const {
-        if (!exists(id)) {
+    std::shared_ptr<Node> const &find_node(id_type const &id) const {
+        auto it = genealogy_.find(id);
+        if (it == genealogy_.end()) {
             throw VirusNotFound();
         }
+        return it->second;
     }
 
     void throw_if_already_created(id_type const &id) const {
@@ -49,6 +64,217 @@ private:
         }
     }
 
+    // Longest path from the stem. With use_cache, results are stored in the
+    // nodes and every cached depth implies cached depths of all ancestors.
+    // Iterative post-order over parents, so long chains don't overflow the
+    // call stack.
+    std::size_t compute_depth(std::shared_ptr<Node> const &node_sp,
+            std::map<Node const*, std::size_t> &memo, bool use_cache) const {
+        auto lookup = [&memo, use_cache](Node const *node, std::size_t &depth) {
+            if (use_cache && node->has_depth()) {
+                depth = node->get_depth();
+                return true;
+            }
+            auto it = memo.find(node);
+            if (it != memo.end()) {
+                depth = it->second;
+                return true;
+            }
+            return false;
+        };
+
+        std::vector<Node*> stack{node_sp.get()};
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            std::size_t depth = 0;
+            if (lookup(node, depth)) {
+                stack.pop_back();
+                continue;
+            }
+
+            bool parents_known = true;
+            node->for_each_parent([&lookup, &stack, &depth, &parents_known]
+                    (std::shared_ptr<Node> const &parent_sp) {
+                std::size_t parent_depth = 0;
+                if (lookup(parent_sp.get(), parent_depth)) {
+                    depth = std::max(depth, parent_depth + 1);
+                } else {
+                    parents_known = false;
+                    stack.push_back(parent_sp.get());
+                }
+            });
+
+            if (parents_known) {
+                stack.pop_back();
+                if (use_cache) {
+                    node->set_depth(depth);
+                } else {
+                    memo[node] = depth;
+                }
+            }
+        }
+
+        std::size_t depth = 0;
+        lookup(node_sp.get(), depth);
+        return depth;
+    } // only touches the cache, therefore strong
+
+    // Number of distinct nodes reachable from node, not counting itself.
+    std::size_t count_descendants(Node const *node) const {
+        std::set<Node const*> visited;
+        std::vector<Node const*> stack{node};
+        while (!stack.empty()) {
+            Node const *current = stack.back();
+            stack.pop_back();
+            current->for_each_child([&visited, &stack](std::shared_ptr<Node> const &child_sp) {
+                if (visited.insert(child_sp.get()).second) {
+                    stack.push_back(child_sp.get());
+                }
+            });
+        }
+        return visited.size();
+    }
+
+    // With use_cache, keeps the invariant that a cached count implies cached
+    // counts of all descendants: they are cached first, in post-order. Nodes
+    // without a cached count are therefore closed upwards, which is what lets
+    // the ancestor walks below stop at the first one.
+    std::size_t compute_descendants(std::shared_ptr<Node> const &node_sp,
+            bool use_cache) const {
+        if (!use_cache) {
+            return count_descendants(node_sp.get());
+        }
+
+        std::vector<Node*> stack{node_sp.get()};
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            if (node->has_descendants()) {
+                stack.pop_back();
+                continue;
+            }
+
+            bool children_cached = true;
+            node->for_each_child([&stack, &children_cached](std::shared_ptr<Node> const &child_sp) {
+                if (!child_sp->has_descendants()) {
+                    children_cached = false;
+                    stack.push_back(child_sp.get());
+                }
+            });
+
+            if (children_cached) {
+                stack.pop_back();
+                // A single child's descendants are exactly the rest of ours,
+                // which keeps chains linear.
+                if (node->child_count() == 1) {
+                    std::size_t descendants = 0;
+                    node->for_each_child([&descendants](std::shared_ptr<Node> const &child_sp) {
+                        descendants = child_sp->get_descendants() + 1;
+                    });
+                    node->set_descendants(descendants);
+                } else {
+                    node->set_descendants(count_descendants(node));
+                }
+            }
+        }
+        return node_sp->get_descendants();
+    } // only touches the cache, therefore strong
+
+    // Nodes with cached descendant counts among nodes and their ancestors;
+    // each of them gains exactly one descendant when a new virus is created
+    // under nodes.
+    std::vector<Node*> cached_ancestors(
+            std::vector<std::shared_ptr<Node>> const &nodes) const {
+        std::set<Node*> visited;
+        std::vector<Node*> stack;
+        for (std::shared_ptr<Node> const &node_sp : nodes) {
+            if (node_sp->has_descendants() && visited.insert(node_sp.get()).second) {
+                stack.push_back(node_sp.get());
+            }
+        }
+
+        std::vector<Node*> ancestors;
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+            ancestors.push_back(node);
+            node->for_each_parent([&visited, &stack](std::shared_ptr<Node> const &parent_sp) {
+                if (parent_sp->has_descendants() &&
+                        visited.insert(parent_sp.get()).second) {
+                    stack.push_back(parent_sp.get());
+                }
+            });
+        }
+        return ancestors;
+    } // const, therefore strong
+
+    // Relies on the invariant kept by compute_depth: a node without a cached
+    // depth has no descendants with one, so we can stop there. If the walk
+    // can't finish, dropping every cached depth keeps that invariant.
+    void invalidate_depth_from(std::shared_ptr<Node> const &node_sp) {
+        if (!node_sp->has_depth()) {
+            return;
+        }
+
+        try {
+            std::vector<Node*> stack{node_sp.get()};
+            node_sp->invalidate_depth();
+            while (!stack.empty()) {
+                Node *node = stack.back();
+                stack.pop_back();
+                node->for_each_child([&stack](std::shared_ptr<Node> const &child_sp) {
+                    if (child_sp->has_depth()) {
+                        stack.push_back(child_sp.get());
+                        child_sp->invalidate_depth();
+                    }
+                });
+            }
+        } catch (...) {
+            for (auto &pair : genealogy_) {
+                pair.second->invalidate_depth();
+            }
+        }
+    } // no-throw
+
+    // Drops cached counts of node_sp and its ancestors. Stops at uncached
+    // nodes, as their ancestors aren't cached either.
+    void invalidate_descendants_upwards(std::shared_ptr<Node> const &node_sp) {
+        if (!node_sp->has_descendants()) {
+            return;
+        }
+
+        try {
+            std::vector<Node*> stack{node_sp.get()};
+            node_sp->invalidate_descendants();
+            while (!stack.empty()) {
+                Node *node = stack.back();
+                stack.pop_back();
+                node->for_each_parent([&stack](std::shared_ptr<Node> const &parent_sp) {
+                    if (parent_sp->has_descendants()) {
+                        stack.push_back(parent_sp.get());
+                        parent_sp->invalidate_descendants();
+                    }
+                });
+            }
+        } catch (...) {
+            for (auto &pair : genealogy_) {
+                pair.second->invalidate_descendants();
+            }
+        }
+    } // no-throw
+
+    // Adds the edge unless it already exists; doesn't touch the cache.
+    void link(std::shared_ptr<Node> &child_sp, std::shared_ptr<Node> &parent_sp) {
+        if (!child_sp->edge_exists(parent_sp)) {
+            child_sp->add_parent(parent_sp);
+            try {
+                parent_sp->add_child(child_sp);
+            } catch (...) {
+                child_sp->remove_parent(parent_sp);
+                throw;
+            }
+        }
+    } // try-catch-reverse makes whole function strong
+
     class Node {
     private:
     
@@ -60,6 +286,13 @@ private:
         map_iter iter_;
         bool pending_remove;
 
+        // Cached metrics, only maintained while the genealogy's metrics
+        // cache is enabled.
+        std::size_t depth_;
+        bool depth_valid_;
+        std::size_t descendants_;
+        bool descendants_valid_;
+
         std::set<std::weak_ptr<Node>, 
                  std::owner_less<std::weak_ptr<Node>>> children_;
         std::set<std::weak_ptr<Node>, 
@@ -67,7 +300,9 @@ private:
         
     public:
                 
-        Node(id_type const &id) : virus_(id), id_(id), pending_remove(false) {
+        Node(id_type const &id) : virus_(id), id_(id), pending_remove(false),
+                depth_(0), depth_valid_(false),
+                descendants_(0), descendants_valid_(false) {
         }
 		
 		Node(Node const& obj) : Node(obj.id_) {
@@ -75,6 +310,7 @@ private:
 			children_ = obj.children_;
 			iter_ = obj.iter_;
 			pending_remove = obj.pending_remove;
+			copy_metrics(obj);
 		}
 		
 		Node& operator=(const Node& obj)
@@ -83,6 +319,7 @@ private:
 			children_ = obj.children_;
 			iter_ = obj.iter_;
 			pending_remove = obj.pending_remove;
+			copy_metrics(obj);
 			return *this;
 		}
 		
@@ -120,6 +357,28 @@ private:
             return children_ids; 
         }
 
+        std::size_t child_count() const {
+            return children_.size(); // no-throw
+        }
+
+        std::size_t parent_count() const {
+            return parents_.size(); // no-throw
+        }
+
+        template<class F>
+        void for_each_child(F f) const {
+            for (std::weak_ptr<Node> const &node_wp : children_) {
+                f(node_wp.lock());
+            }
+        }
+
+        template<class F>
+        void for_each_parent(F f) const {
+            for (std::weak_ptr<Node> const &node_wp : parents_) {
+                f(node_wp.lock());
+            }
+        }
+
         std::vector<id_type> get_parents() const {
             std::vector<id_type> parent_ids;
             for (std::weak_ptr<Node> node_wp : parents_) {
@@ -135,7 +394,7 @@ private:
             return virus_;
         }
 
-        id_type get_id() const {
+        id_type const &get_id() const {
             return id_;
         }
         
@@ -154,11 +413,115 @@ private:
 		void set_pending_remove(bool b) {
 			pending_remove = b;
 		}
+
+        // Unlike assignment, doesn't allocate.
+        void swap_links(Node &obj) {
+            parents_.swap(obj.parents_);
+            children_.swap(obj.children_);
+            std::swap(iter_, obj.iter_);
+            std::swap(pending_remove, obj.pending_remove);
+            std::swap(depth_, obj.depth_);
+            std::swap(depth_valid_, obj.depth_valid_);
+            std::swap(descendants_, obj.descendants_);
+            std::swap(descendants_valid_, obj.descendants_valid_);
+        } // no-throw
+
+        void copy_metrics(Node const &obj) {
+            depth_ = obj.depth_;
+            depth_valid_ = obj.depth_valid_;
+            descendants_ = obj.descendants_;
+            descendants_valid_ = obj.descendants_valid_;
+        } // no-throw
+
+        bool has_depth() const {
+            return depth_valid_;
+        }
+
+        std::size_t get_depth() const {
+            return depth_;
+        }
+
+        void set_depth(std::size_t depth) {
+            depth_ = depth;
+            depth_valid_ = true;
+        }
+
+        void invalidate_depth() {
+            depth_valid_ = false;
+        }
+
+        bool has_descendants() const {
+            return descendants_valid_;
+        }
+
+        std::size_t get_descendants() const {
+            return descendants_;
+        }
+
+        void set_descendants(std::size_t descendants) {
+            descendants_ = descendants;
+            descendants_valid_ = true;
+        }
+
+        void add_descendant() {
+            descendants_++;
+        }
+
+        void invalidate_descendants() {
+            descendants_valid_ = false;
+        }
     };
     
 public:
 
-    VirusGenealogy(id_type const &stem_id) : stem_id_(stem_id) {
+    // Refers to a node directly, so queries through it skip the index.
+    // Stays valid until the node is removed; a virus created later with the
+    // same id gets a new node. Other genealogies, including ones created
+    // later at the same address, treat it as not found.
+    class NodeHandle {
+    private:
+
+        friend class VirusGenealogy;
+
+        std::size_t instance_id_;
+        std::weak_ptr<Node> node_wp_;
+        Node *node_;
+        mutable std::size_t generation_;
+
+        NodeHandle(std::size_t instance_id,
+                std::shared_ptr<Node> const &node_sp, std::size_t generation)
+            : instance_id_(instance_id), node_wp_(node_sp), node_(node_sp.get()),
+              generation_(generation) {
+        }
+
+    public:
+
+        NodeHandle() : instance_id_(0), node_(nullptr), generation_(0) {
+        }
+    };
+
+private:
+
+    // Uses the handle's pointer directly while no remove() has happened
+    // since it was last validated; otherwise asks the weak pointer.
+    Node* find_node(NodeHandle const &handle) const {
+        if (handle.instance_id_ != instance_id_ || handle.node_ == nullptr) {
+            throw VirusNotFound();
+        }
+        if (handle.generation_ != generation_) {
+            if (handle.node_wp_.expired()) {
+                throw VirusNotFound();
+            }
+            handle.generation_ = generation_;
+        }
+        return handle.node_;
+    }
+
+public:
+
+    VirusGenealogy(id_type const &stem_id) : stem_id_(stem_id),
+            metrics_cache_enabled_(false), instance_id_(next_instance_id()),
+            generation_(0) {
         std::shared_ptr<Node> node_sp = std::make_shared<Node>(Node(stem_id));
         auto it = genealogy_.insert(std::make_pair(stem_id, node_sp)).first;
         node_sp->set_iter(it);
@@ -174,16 +537,12 @@ public:
 
     std::vector<id_type>
         get_children(id_type const &id) const {
-        throw_if_not_found(id);
-
-        std::shared_ptr<Node> node_sp = genealogy_.find(id)->second;
+        std::shared_ptr<Node> const &node_sp = find_node(id);
         return node_sp->get_children();
     }
 
     std::vector<id_type> get_parents(id_type const &id) const {
-        throw_if_not_found(id);
-
-        std::shared_ptr<Node> node_sp = genealogy_.find(id)->second;
+        std::shared_ptr<Node> const &node_sp = find_node(id);
         return node_sp->get_parents();
     }
 
@@ -191,10 +550,145 @@ public:
         return genealogy_.find(id) != genealogy_.end();
     }
 
-    Virus& operator[](id_type const &id) const {
-        throw_if_not_found(id);
+    // Returns an empty handle if the virus doesn't exist.
+    NodeHandle find_handle(id_type const &id) const {
+        auto it = genealogy_.find(id);
+        if (it == genealogy_.end()) {
+            return NodeHandle();
+        }
+        return NodeHandle(instance_id_, it->second, generation_);
+    }
+
+    bool exists(NodeHandle const &handle) const {
+        return handle.instance_id_ == instance_id_ && handle.node_ != nullptr &&
+            (handle.generation_ == generation_ ||
+                !handle.node_wp_.expired());
+    } // no-throw
+
+    std::vector<id_type> get_children(NodeHandle const &handle) const {
+        return find_node(handle)->get_children();
+    }
+
+    std::vector<id_type> get_parents(NodeHandle const &handle) const {
+        return find_node(handle)->get_parents();
+    }
+
+    Virus& operator[](NodeHandle const &handle) const {
+        return find_node(handle)->get_virus();
+    }
+
+    std::size_t child_count(NodeHandle const &handle) const {
+        return find_node(handle)->child_count();
+    }
+
+    std::size_t parent_count(NodeHandle const &handle) const {
+        return find_node(handle)->parent_count();
+    }
+
+    std::size_t size() const {
+        return genealogy_.size();
+    }
+
+    // Calls f(id) for every virus, in increasing id order.
+    template<class F>
+    void for_each_virus(F f) const {
+        for (auto const &pair : genealogy_) {
+            f(pair.first);
+        }
+    }
+
+    // Calls f(parent_id, child_id) for every edge, in increasing order of
+    // parent and then child id, so the order doesn't depend on where nodes
+    // were allocated.
+    template<class F>
+    void for_each_edge(F f) const {
+        std::vector<Node const*> children;
+        for (auto const &pair : genealogy_) {
+            children.clear();
+            pair.second->for_each_child([&children](std::shared_ptr<Node> const &child_sp) {
+                children.push_back(child_sp.get());
+            });
+            std::sort(children.begin(), children.end(),
+                    [](Node const *a, Node const *b) {
+                return a->get_id() < b->get_id();
+            });
+            for (Node const *child : children) {
+                f(pair.first, child->get_id());
+            }
+        }
+    }
+
+    std::size_t child_count(id_type const &id) const {
+        return find_node(id)->child_count();
+    }
+
+    std::size_t parent_count(id_type const &id) const {
+        return find_node(id)->parent_count();
+    }
+
+    // Length of the longest path from the stem to the virus.
+    // Not safe to call concurrently while the metrics cache is enabled.
+    std::size_t depth(id_type const &id) const {
+        std::map<Node const*, std::size_t> memo;
+        return compute_depth(find_node(id), memo,
+                metrics_cache_enabled_);
+    }
+
+    // Number of distinct viruses reachable from the virus.
+    // Not safe to call concurrently while the metrics cache is enabled.
+    std::size_t descendant_count(id_type const &id) const {
+        return compute_descendants(find_node(id),
+                metrics_cache_enabled_);
+    }
+
+    // While enabled, depth() and descendant_count() results are kept in the
+    // nodes. create() updates them in place; connect() and remove() drop
+    // only the entries they affect.
+    // Note that the cache makes these two const queries write to the nodes,
+    // so while it is enabled they must not run concurrently with each other
+    // or with any other call on the same genealogy.
+    void enable_metrics_cache() {
+        metrics_cache_enabled_ = true;
+    }
+
+    void disable_metrics_cache() {
+        for (auto &pair : genealogy_) {
+            pair.second->invalidate_depth();
+            pair.second->invalidate_descendants();
+        }
+        metrics_cache_enabled_ = false;
+    } // no-throw
 
-        std::shared_ptr<Node> node_sp = genealogy_.find(id)->second;
+    bool metrics_cache_enabled() const {
+        return metrics_cache_enabled_;
+    }
+
+    // Compares every cached metric with a freshly computed one.
+    bool check_metrics_cache() const {
+        std::map<Node const*, std::size_t> memo;
+        for (auto const &pair : genealogy_) {
+            std::shared_ptr<Node> const &node_sp = pair.second;
+            if (node_sp->has_depth() &&
+                    node_sp->get_depth() != compute_depth(node_sp, memo, false)) {
+                return false;
+            }
+            if (node_sp->has_descendants() &&
+                    node_sp->get_descendants() != compute_descendants(node_sp, false)) {
+                return false;
+            }
+            bool children_cached = true;
+            node_sp->for_each_child([&children_cached](std::shared_ptr<Node> const &child_sp) {
+                children_cached = children_cached && child_sp->has_descendants();
+            });
+            if (node_sp->has_descendants() && !children_cached) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Virus& operator[](id_type const &id) const {
+        std::shared_ptr<Node> const &node_sp = find_node(id);
         return node_sp->get_virus();
     }
 
@@ -209,11 +703,12 @@ public:
         
         std::vector<std::shared_ptr<Node>> nodes;
         for (std::size_t i = 0; i < parent_ids.size(); i++) {
-            throw_if_not_found(parent_ids[i]);
+            nodes.push_back(find_node(parent_ids[i]));
         }
-        
-         for (std::size_t i = 0; i < parent_ids.size(); i++) {
-            nodes.push_back(genealogy_.find(parent_ids[i])->second); 
+
+        std::vector<Node*> ancestors;
+        if (metrics_cache_enabled_) {
+            ancestors = cached_ancestors(nodes);
         }
         
         std::shared_ptr<Node> node_sp = std::make_shared<Node>(id);
@@ -221,8 +716,8 @@ public:
         
         try {
             node_sp->set_iter(it);
-            for (std::size_t i = 0; i < parent_ids.size(); i++) {
-                connect(id, parent_ids[i]);
+            for (std::size_t i = 0; i < nodes.size(); i++) {
+                link(node_sp, nodes[i]);
             }
         } catch (...) {
             genealogy_.erase(it);
@@ -232,26 +727,37 @@ public:
             }
             throw;
         }
+
+        if (metrics_cache_enabled_) {
+            for (Node *ancestor : ancestors) {
+                ancestor->add_descendant();
+            }
+            node_sp->set_descendants(0);
+            bool parents_cached = true;
+            std::size_t depth = 0;
+            for (std::size_t i = 0; i < nodes.size(); i++) {
+                parents_cached = parents_cached && nodes[i]->has_depth();
+                depth = std::max(depth, nodes[i]->get_depth() + 1);
+            }
+            if (parents_cached) {
+                node_sp->set_depth(depth);
+            }
+        } // no-throw
     } // try-catch-reverse makes the whole function strong
 
     void connect(id_type const &child_id, id_type const &parent_id) {
-        throw_if_not_found(child_id);
-        throw_if_not_found(parent_id);
-
-        std::shared_ptr<Node> child_sp = genealogy_.find(child_id)->second;
-
-        std::shared_ptr<Node> parent_sp = genealogy_.find(parent_id)->second;
+        std::shared_ptr<Node> child_sp = find_node(child_id);
+        std::shared_ptr<Node> parent_sp = find_node(parent_id);
         
-        if (!child_sp->edge_exists(parent_sp)) {
-            child_sp->add_parent(parent_sp);
-            try {
-                parent_sp->add_child(child_sp);
-            } catch (...) {
-                child_sp->remove_parent(parent_sp);
-                throw;
+        if (metrics_cache_enabled_ && !child_sp->edge_exists(parent_sp)) {
+            invalidate_descendants_upwards(parent_sp);
+            if (!(child_sp->has_depth() && parent_sp->has_depth() &&
+                    parent_sp->get_depth() < child_sp->get_depth())) {
+                invalidate_depth_from(child_sp);
             }
         }
-    } // try-catch-reverse makes whole function strong
+        link(child_sp, parent_sp);
+    } // cache changes come first and are no-throw, link() is strong
     
     std::vector<std::shared_ptr<Node>> remove_helper(id_type id,
          std::map<id_type, std::shared_ptr<Node>> &gen_tmp, bool first) {	
@@ -306,9 +812,13 @@ public:
         if (id == stem_id_) {
            throw TriedToRemoveStemVirus();
         }
-        throw_if_not_found(id);
-
-        std::shared_ptr<Node> node_sp = genealogy_.find(id)->second;
+        std::shared_ptr<Node> node_sp = find_node(id);
+        if (metrics_cache_enabled_) {
+            node_sp->for_each_parent([this](std::shared_ptr<Node> const &parent_sp) {
+                invalidate_descendants_upwards(parent_sp);
+            });
+            invalidate_depth_from(node_sp);
+        }
         Node node_to_remove = *node_sp;
         std::map<id_type, std::shared_ptr<Node>> mapa;
         mapa.insert(std::make_pair(id, std::make_shared<Node>(node_to_remove)));
@@ -316,16 +826,16 @@ public:
                                            remove_helper(id, mapa, true);
         
         for (auto affected_node : affected_nodes) {
-            Node node = *affected_node;
-            auto it = node.get_iter();
-            if (!node.get_pending_remove()) {
-                std::swap(*(it->second), node);    
+            auto it = affected_node->get_iter();
+            if (!affected_node->get_pending_remove()) {
+                it->second->swap_links(*affected_node);
             }
             else {
                 genealogy_.erase(it); 
             }
         }
-    }
+        generation_++;
+    } // everything that can throw happens on copies, commit is no-throw
 };
 
 #endif
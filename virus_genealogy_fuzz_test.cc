@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "testing.h"
+#include "virus_genealogy.h"
+
+// Randomized differential test: drives VirusGenealogy and a trivial
+// reference model with the same operations, injecting allocation and Virus
+// constructor failures, and checks that a failed operation leaves the
+// genealogy unchanged.
+//
+// Usage: virus_genealogy_fuzz_test [operations [seed]]
+//        virus_genealogy_fuzz_test scale [operations [max_size [seed [max_avg_ns]]]]
+// Every run is done once with the metrics cache disabled and once with it
+// enabled. Without arguments, differential runs use seeds 1 to 16 with
+// 10000 operations each (bugs tend to show up early in a run, so many short
+// runs find more than a few long ones), followed by a scale run of 20000
+// operations on up to 5000 viruses. "scale" does only the scale run, which
+// reports per-operation timings; millions of operations on large graphs
+// just need bigger arguments. With max_avg_ns, a scale run also fails when
+// any operation's average time exceeds it.
+
+namespace {
+
+// When positive, counts down allocations; the one that reaches zero throws.
+long alloc_countdown = 0;
+
+// Same for FuzzVirus constructions.
+long virus_countdown = 0;
+
+}
+
+void* operator new(std::size_t size) {
+    if (alloc_countdown > 0 && --alloc_countdown == 0) {
+        throw std::bad_alloc();
+    }
+    void *ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+class VirusConstructionFailed : public std::exception {
+    const char* what() const noexcept {
+        return "Virus construction failed!";
+    }
+};
+
+class FuzzVirus {
+public:
+    typedef int id_type;
+    FuzzVirus(id_type const &_id) : id(_id) {
+        if (virus_countdown > 0 && --virus_countdown == 0) {
+            throw VirusConstructionFailed();
+        }
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+enum class Outcome { OK, NOT_FOUND, ALREADY_CREATED, STEM, INJECTED };
+
+struct Snapshot {
+    std::map<int, std::set<int>> children;
+    std::map<int, std::set<int>> parents;
+
+    bool operator==(Snapshot const &other) const {
+        return children == other.children && parents == other.parents;
+    }
+};
+
+class Model {
+public:
+    Model(int stem) : stem_(stem) {
+        graph_.children[stem];
+        graph_.parents[stem];
+        add_id(stem);
+    }
+
+    bool exists(int id) const {
+        return graph_.children.count(id) > 0;
+    }
+
+    Outcome create(int id, std::vector<int> const &parent_ids) {
+        if (exists(id)) {
+            return Outcome::ALREADY_CREATED;
+        }
+        if (parent_ids.empty()) {
+            return Outcome::NOT_FOUND;
+        }
+        for (int parent_id : parent_ids) {
+            if (!exists(parent_id)) {
+                return Outcome::NOT_FOUND;
+            }
+        }
+        return Outcome::OK;
+    }
+
+    void apply_create(int id, std::vector<int> const &parent_ids) {
+        graph_.children[id];
+        graph_.parents[id];
+        add_id(id);
+        for (int parent_id : parent_ids) {
+            apply_connect(id, parent_id);
+        }
+    }
+
+    Outcome connect(int child_id, int parent_id) const {
+        return exists(child_id) && exists(parent_id) ?
+            Outcome::OK : Outcome::NOT_FOUND;
+    }
+
+    void apply_connect(int child_id, int parent_id) {
+        graph_.children[parent_id].insert(child_id);
+        graph_.parents[child_id].insert(parent_id);
+    }
+
+    Outcome remove(int id) const {
+        if (id == stem_) {
+            return Outcome::STEM;
+        }
+        return exists(id) ? Outcome::OK : Outcome::NOT_FOUND;
+    }
+
+    void apply_remove(int id) {
+        for (int parent_id : graph_.parents[id]) {
+            graph_.children[parent_id].erase(id);
+        }
+        std::set<int> children = graph_.children[id];
+        graph_.children.erase(id);
+        graph_.parents.erase(id);
+        remove_id(id);
+        for (int child_id : children) {
+            graph_.parents[child_id].erase(id);
+            if (graph_.parents[child_id].empty()) {
+                apply_remove(child_id);
+            }
+        }
+    }
+
+    // Iterative, as chains in scale runs are too deep for recursion.
+    std::size_t depth(int id) const {
+        std::map<int, std::size_t> memo;
+        std::vector<int> stack{id};
+        while (!stack.empty()) {
+            int node = stack.back();
+            if (memo.count(node) > 0) {
+                stack.pop_back();
+                continue;
+            }
+            std::size_t depth = 0;
+            bool parents_known = true;
+            for (int parent_id : graph_.parents.at(node)) {
+                auto it = memo.find(parent_id);
+                if (it == memo.end()) {
+                    parents_known = false;
+                    stack.push_back(parent_id);
+                } else {
+                    depth = std::max(depth, it->second + 1);
+                }
+            }
+            if (parents_known) {
+                memo[node] = depth;
+                stack.pop_back();
+            }
+        }
+        return memo[id];
+    }
+
+    std::size_t descendant_count(int id) const {
+        std::set<int> visited;
+        std::vector<int> stack{id};
+        while (!stack.empty()) {
+            int node = stack.back();
+            stack.pop_back();
+            for (int child_id : graph_.children.at(node)) {
+                if (visited.insert(child_id).second) {
+                    stack.push_back(child_id);
+                }
+            }
+        }
+        return visited.size();
+    }
+
+    Snapshot const &snapshot() const {
+        return graph_;
+    }
+
+    std::size_t size() const {
+        return graph_.children.size();
+    }
+
+    // Returns the k-th (modulo size) live virus in O(1); the stem is always
+    // at position 0.
+    int nth(std::size_t k) const {
+        return ids_[k % ids_.size()];
+    }
+
+private:
+    void add_id(int id) {
+        positions_[id] = ids_.size();
+        ids_.push_back(id);
+    }
+
+    void remove_id(int id) {
+        std::size_t position = positions_[id];
+        positions_[ids_.back()] = position;
+        std::swap(ids_[position], ids_.back());
+        ids_.pop_back();
+        positions_.erase(id);
+    }
+
+    int stem_;
+    Snapshot graph_;
+    std::vector<int> ids_;
+    std::map<int, std::size_t> positions_;
+};
+
+Snapshot takeSnapshot(VirusGenealogy<FuzzVirus> const &vg) {
+    Snapshot snapshot;
+    vg.for_each_virus([&snapshot, &vg](int id) {
+            snapshot.children[id];
+            std::vector<int> parents = vg.get_parents(id);
+            snapshot.parents[id].insert(parents.begin(), parents.end());
+            });
+    vg.for_each_edge([&snapshot](int parent_id, int child_id) {
+            snapshot.children[parent_id].insert(child_id);
+            });
+    return snapshot;
+}
+
+template<class F>
+Outcome run(F const &f) {
+    try {
+        f();
+    } catch (VirusNotFound &) {
+        return Outcome::NOT_FOUND;
+    } catch (VirusAlreadyCreated &) {
+        return Outcome::ALREADY_CREATED;
+    } catch (TriedToRemoveStemVirus &) {
+        return Outcome::STEM;
+    } catch (std::bad_alloc &) {
+        return Outcome::INJECTED;
+    } catch (VirusConstructionFailed &) {
+        return Outcome::INJECTED;
+    }
+    return Outcome::OK;
+}
+
+struct QueryResult {
+    bool exists = false;
+    int virus_id = 0;
+    std::set<int> children;
+    std::size_t child_count = 0;
+    std::size_t parent_count = 0;
+    std::size_t depth = 0;
+    std::size_t descendant_count = 0;
+};
+
+struct Timing {
+    std::size_t count = 0;
+    std::chrono::nanoseconds total{0};
+};
+
+// Differential runs keep the graph small and inject failures into a
+// quarter of the operations. Scale runs inject nothing, let the graph grow
+// to max_size with new viruses mostly descending from recent ones (so
+// chains get deep), verify against the model only periodically, and
+// report per-operation timings.
+struct RunConfig {
+    long operations;
+    unsigned seed;
+    bool cache;
+    bool scale;
+    std::size_t max_size;
+    long max_avg_ns;
+};
+
+void testDifferential(RunConfig const &config) {
+    beginTest();
+    std::cout << "  " << (config.scale ? "Scale run" : "Seed") << " "
+        << config.seed << ", metrics cache "
+        << (config.cache ? "enabled" : "disabled") << "." << std::endl;
+
+    std::mt19937 rng(config.seed);
+    auto random = [&rng](int bound) {
+        return std::uniform_int_distribution<int>(0, bound - 1)(rng);
+    };
+
+    VirusGenealogy<FuzzVirus> vg(0);
+    Model model(0);
+    if (config.cache) {
+        vg.enable_metrics_cache();
+    }
+
+    // Out of 10: creates, connects and removes below these bounds, the
+    // rest are queries.
+    const int create_bound = config.scale ? 6 : 4;
+    const int connect_bound = config.scale ? 7 : 6;
+    const int remove_bound = config.scale ? 8 : 7;
+    const long compare_every = config.scale ? 1000 : 16;
+    const long query_check_every = config.scale ? 64 : 1;
+
+    int next_id = 1;
+    long mismatches = 0, unsafe = 0, injected = 0, cache_errors = 0;
+    std::map<std::string, Timing> timings;
+
+    // Ids are never reused, so a handle is valid exactly as long as the
+    // model still has its virus.
+    int held_id = 0;
+    VirusGenealogy<FuzzVirus>::NodeHandle held = vg.find_handle(held_id);
+    long handle_errors = 0;
+
+    long performed = 0;
+    for (long op = 0; op < config.operations; op++, performed++) {
+        auto pick_id = [&]() {
+            return random(4) == 0 ? random(next_id + 2) :
+                model.nth(static_cast<std::size_t>(random(1 << 20)));
+        };
+        auto pick_parent = [&]() {
+            if (config.scale && random(4) != 0) {
+                int recent = next_id - 1 - random(4);
+                if (model.exists(recent)) {
+                    return recent;
+                }
+            }
+            return pick_id();
+        };
+
+        int kind = model.size() > config.max_size ? connect_bound : random(10);
+        std::string name;
+        Outcome expected;
+        std::function<void(void)> real_op, model_op;
+
+        if (kind < create_bound) {
+            name = "create";
+            int id = random(10) == 0 ? pick_id() : next_id++;
+            std::vector<int> parent_ids;
+            int count = random(10) == 0 ? 0 : 1 + random(3);
+            for (int i = 0; i < count; i++) {
+                int parent_id = pick_parent();
+                parent_ids.push_back(parent_id < id ? parent_id : 0);
+            }
+            expected = model.create(id, parent_ids);
+            real_op = [&vg, id, parent_ids] {
+                if (parent_ids.size() == 1) {
+                    vg.create(id, parent_ids[0]);
+                } else {
+                    vg.create(id, parent_ids);
+                }
+            };
+            model_op = [&model, id, parent_ids] { model.apply_create(id, parent_ids); };
+        } else if (kind < connect_bound) {
+            name = "connect";
+            int a = pick_id(), b = pick_id();
+            if (a == b) {
+                b = next_id + 1;
+            }
+            int child_id = std::max(a, b), parent_id = std::min(a, b);
+            expected = model.connect(child_id, parent_id);
+            real_op = [&vg, child_id, parent_id] { vg.connect(child_id, parent_id); };
+            model_op = [&model, child_id, parent_id] {
+                model.apply_connect(child_id, parent_id);
+            };
+        } else if (kind < remove_bound) {
+            name = "remove";
+            int id = model.size() > config.max_size ?
+                model.nth(1 + random(static_cast<int>(config.max_size))) : pick_id();
+            expected = model.remove(id);
+            real_op = [&vg, id] { vg.remove(id); };
+            model_op = [&model, id] { model.apply_remove(id); };
+        } else {
+            name = "query";
+            int id = pick_id();
+            expected = model.exists(id) ? Outcome::OK : Outcome::NOT_FOUND;
+            std::shared_ptr<QueryResult> result = std::make_shared<QueryResult>();
+            real_op = [&vg, result, id] {
+                result->exists = vg.exists(id);
+                result->virus_id = vg[id].get_id();
+                std::vector<int> children = vg.get_children(id);
+                result->children.insert(children.begin(), children.end());
+                result->child_count = vg.child_count(id);
+                result->parent_count = vg.parent_count(id);
+                result->depth = vg.depth(id);
+                result->descendant_count = vg.descendant_count(id);
+            };
+            bool check_result = op % query_check_every == 0;
+            model_op = [&model, &mismatches, result, id, check_result] {
+                if (check_result && !(result->exists && result->virus_id == id &&
+                        result->children == model.snapshot().children.at(id) &&
+                        result->child_count == result->children.size() &&
+                        result->parent_count == model.snapshot().parents.at(id).size() &&
+                        result->depth == model.depth(id) &&
+                        result->descendant_count == model.descendant_count(id))) {
+                    mismatches++;
+                }
+            };
+        }
+
+        bool inject = !config.scale && random(4) == 0;
+        if (inject) {
+            if (random(2) == 0) {
+                // A cascading remove allocates a lot before it commits.
+                alloc_countdown = 1 + random(name == "remove" && random(2) == 0 ? 400 : 40);
+            } else {
+                virus_countdown = 1 + random(4);
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        Outcome outcome = run(real_op);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        alloc_countdown = 0;
+        virus_countdown = 0;
+
+        if (outcome == Outcome::INJECTED) {
+            injected++;
+        } else {
+            if (outcome != expected) {
+                mismatches++;
+            } else if (outcome == Outcome::OK) {
+                model_op();
+            }
+            if (config.scale) {
+                Timing &timing = timings[name];
+                timing.count++;
+                timing.total += elapsed;
+            }
+        }
+
+        // Failed operations are always compared in full, as that's where
+        // exception safety is checked; otherwise a periodic comparison is
+        // enough to catch divergence and keeps long runs affordable.
+        bool compare = outcome == Outcome::INJECTED || op % compare_every == 0;
+        if (compare && !(takeSnapshot(vg) == model.snapshot())) {
+            if (outcome == Outcome::INJECTED) {
+                unsafe++;
+            } else {
+                mismatches++;
+            }
+            std::cout << "  Diverged at operation " << op << " (" << name
+                << "), seed " << config.seed << ".\n";
+            break;
+        }
+        // Checking every cached metric is quadratic, so scale runs only do
+        // it once at the end.
+        if (compare && !config.scale && !vg.check_metrics_cache()) {
+            cache_errors++;
+        }
+
+        if (vg.exists(held) != model.exists(held_id) ||
+                (model.exists(held_id) &&
+                 vg.child_count(held) != model.snapshot().children.at(held_id).size())) {
+            handle_errors++;
+        }
+        if (!model.exists(held_id) || random(8) == 0) {
+            held_id = model.nth(static_cast<std::size_t>(random(1 << 20)));
+            held = vg.find_handle(held_id);
+        }
+    }
+
+    if (config.scale && !vg.check_metrics_cache()) {
+        cache_errors++;
+    }
+
+    std::cout << "  " << performed << " operations, " << injected
+        << " injected failures, " << model.size() << " viruses at the end.\n";
+    checkEqual(mismatches, 0L, "Genealogy agrees with the reference model.");
+    checkEqual(unsafe, 0L, "Failed operations left the genealogy unchanged.");
+    checkEqual(cache_errors, 0L, "Metrics cache stayed consistent.");
+    checkEqual(handle_errors, 0L, "Handles detected removed viruses.");
+
+    if (!config.scale) {
+        return;
+    }
+    bool within_budget = true;
+    for (auto const &pair : timings) {
+        long avg = pair.second.count == 0 ? 0 :
+            static_cast<long>(pair.second.total.count() / pair.second.count);
+        std::cout << "  " << pair.first << ": " << pair.second.count
+            << " ops, " << avg << " ns avg\n";
+        within_budget = within_budget &&
+            (config.max_avg_ns <= 0 || avg <= config.max_avg_ns);
+    }
+    if (config.max_avg_ns > 0) {
+        check(within_budget, "Average operation time within budget.");
+    }
+}
+
+int main(int argc, char **argv) {
+    bool scale_only = argc > 1 && std::string(argv[1]) == "scale";
+    if (scale_only) {
+        argc--;
+        argv++;
+    }
+
+    if (scale_only) {
+        long operations = argc > 1 ? std::atol(argv[1]) : 20000;
+        std::size_t max_size = argc > 2 ? std::atol(argv[2]) : 5000;
+        unsigned seed = argc > 3 ? std::atoi(argv[3]) : 1;
+        long max_avg_ns = argc > 4 ? std::atol(argv[4]) : 0;
+        testDifferential({operations, seed, false, true, max_size, max_avg_ns});
+        testDifferential({operations, seed, true, true, max_size, max_avg_ns});
+        return 0;
+    }
+
+    long operations = argc > 1 ? std::atol(argv[1]) : 10000;
+    unsigned first_seed = argc > 2 ? std::atoi(argv[2]) : 1;
+    unsigned last_seed = argc > 2 ? first_seed : 16;
+
+    for (unsigned seed = first_seed; seed <= last_seed; seed++) {
+        testDifferential({operations, seed, false, false, 50, 0});
+        testDifferential({operations, seed, true, false, 50, 0});
+    }
+    if (argc <= 1) {
+        testDifferential({20000, 1, false, true, 5000, 0});
+        testDifferential({20000, 1, true, true, 5000, 0});
+    }
+}
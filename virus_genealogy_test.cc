@@ -1,5 +1,7 @@
 #include <algorithm>
+#include <new>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include "testing.h"
 #include "virus_genealogy.h"
@@ -236,6 +238,206 @@ void testRemove() {
     checkSameSet(parents, expected_parents, "Virus has only one parent left.");
 }
 
+void testChildAndParentCount() {
+    beginTest();
+
+    SmallGenealogy smallGenealogy;
+
+    checkEqual<std::size_t>(smallGenealogy.child_count("A"), 4,
+            "Stem has the correct number of children.");
+    checkEqual<std::size_t>(smallGenealogy.parent_count("A"), 0,
+            "Stem has no parents.");
+    checkEqual<std::size_t>(smallGenealogy.parent_count("ABCD"), 2,
+            "Inner node has the correct number of parents.");
+    checkEqual<std::size_t>(smallGenealogy.child_count("F"), 0,
+            "Leaf has no children.");
+
+    checkExceptionThrown<VirusNotFound>(
+            [&smallGenealogy] { smallGenealogy.child_count("G"); },
+            "Can't count children of virus not in the genealogy.");
+}
+
+void testIteration() {
+    beginTest();
+
+    SmallGenealogy smallGenealogy;
+
+    std::vector<std::string> ids;
+    smallGenealogy.for_each_virus([&ids](std::string const &id) {
+            ids.push_back(id);
+            });
+    std::vector<std::string> expected = {"A", "AB", "ABCD", "B", "C", "CD",
+        "D", "E", "F"};
+    checkEqual(ids, expected, "Visited every virus in id order.");
+    checkEqual<std::size_t>(smallGenealogy.size(), 9, "Size matches.");
+
+    std::size_t edges = 0;
+    bool edgesMatch = true;
+    smallGenealogy.for_each_edge([&smallGenealogy, &edges, &edgesMatch]
+            (std::string const &parent, std::string const &child) {
+            std::vector<std::string> children = smallGenealogy.get_children(parent);
+            edgesMatch = edgesMatch &&
+                std::find(children.begin(), children.end(), child) != children.end();
+            edges++;
+            });
+    check(edgesMatch, "Visited edges exist.");
+    checkEqual<std::size_t>(edges, 11, "Visited every edge.");
+}
+
+void testMetrics() {
+    beginTest();
+
+    SmallGenealogy smallGenealogy;
+
+    checkEqual<std::size_t>(smallGenealogy.depth("A"), 0, "Stem has depth 0.");
+    checkEqual<std::size_t>(smallGenealogy.depth("ABCD"), 3,
+            "Depth follows the longest path.");
+    checkEqual<std::size_t>(smallGenealogy.descendant_count("A"), 8,
+            "Stem has all other viruses as descendants.");
+    checkEqual<std::size_t>(smallGenealogy.descendant_count("B"), 3,
+            "Inner node has the correct number of descendants.");
+
+    smallGenealogy.enable_metrics_cache();
+    smallGenealogy.depth("F");
+    smallGenealogy.depth("E");
+    smallGenealogy.descendant_count("A");
+    smallGenealogy.descendant_count("CD");
+    check(smallGenealogy.check_metrics_cache(), "Cache consistent after queries.");
+
+    smallGenealogy.create("G", "F");
+    check(smallGenealogy.check_metrics_cache(), "Cache consistent after create.");
+    checkEqual<std::size_t>(smallGenealogy.depth("G"), 4,
+            "New virus has the correct depth.");
+    checkEqual<std::size_t>(smallGenealogy.descendant_count("A"), 9,
+            "Ancestors see the new descendant.");
+
+    smallGenealogy.connect("E", "ABCD");
+    check(smallGenealogy.check_metrics_cache(), "Cache consistent after connect.");
+    checkEqual<std::size_t>(smallGenealogy.depth("E"), 4,
+            "Depth updated after connect.");
+    checkEqual<std::size_t>(smallGenealogy.descendant_count("CD"), 4,
+            "Descendant count updated after connect.");
+
+    smallGenealogy.remove("CD");
+    check(smallGenealogy.check_metrics_cache(), "Cache consistent after remove.");
+    checkEqual<std::size_t>(smallGenealogy.descendant_count("A"), 6,
+            "Descendant count updated after remove.");
+    checkEqual<std::size_t>(smallGenealogy.depth("E"), 4,
+            "Depth kept after remove.");
+}
+
+void buildChain(VirusGenealogy<Virus<std::string>> &vg, int length,
+        bool query) {
+    std::string parent = vg.get_stem_id();
+    for (int i = 1; i < length; i++) {
+        std::string id = std::to_string(i);
+        vg.create(id, parent);
+        vg.connect(id, vg.get_stem_id());
+        if (query) {
+            vg.depth(id);
+        }
+        parent = id;
+    }
+}
+
+void testMetricsCacheOnChain() {
+    beginTest();
+
+    const int length = 2000;
+
+    SingleVirusGenealogy cached;
+    cached.enable_metrics_cache();
+    cached.descendant_count("A");
+    buildChain(cached, length, true);
+
+    checkEqual<std::size_t>(cached.depth(std::to_string(length - 1)), length - 1,
+            "Depth tracked along the chain.");
+    checkEqual<std::size_t>(cached.descendant_count("A"), length - 1,
+            "Descendant count tracked along the chain.");
+    check(cached.check_metrics_cache(), "Cache consistent along the chain.");
+}
+
+void testMetricsOnLongChain() {
+    beginTest();
+
+    const int length = 100000;
+
+    SingleVirusGenealogy chain;
+    buildChain(chain, length, false);
+    std::string last = std::to_string(length - 1);
+
+    checkEqual<std::size_t>(chain.depth(last), length - 1,
+            "Uncached depth of a long chain.");
+
+    chain.enable_metrics_cache();
+    checkEqual<std::size_t>(chain.depth(last), length - 1,
+            "Cached depth of a long chain.");
+
+    chain.create("X", "A");
+    chain.connect("1", "X");
+    checkEqual<std::size_t>(chain.depth(last), length,
+            "Depth of a long chain updated after connect.");
+    check(chain.check_metrics_cache(), "Cache consistent on a long chain.");
+}
+
+void testHandles() {
+    beginTest();
+
+    SmallGenealogy smallGenealogy;
+
+    auto missing = smallGenealogy.find_handle("G");
+    checkFalse(smallGenealogy.exists(missing), "No handle for missing virus.");
+    checkExceptionThrown<VirusNotFound>(
+            [&smallGenealogy, &missing] { smallGenealogy.get_children(missing); },
+            "Can't query through an empty handle.");
+
+    auto handle = smallGenealogy.find_handle("ABCD");
+    auto leaf = smallGenealogy.find_handle("F");
+    check(smallGenealogy.exists(handle), "Handle refers to existing virus.");
+    checkEqual<std::string>(smallGenealogy[handle].get_id(), "ABCD",
+            "Got the correct virus through the handle.");
+    checkSameSet(smallGenealogy.get_parents(handle),
+            std::vector<std::string>{"AB", "CD"}, "Got the correct parents.");
+
+    smallGenealogy.remove("CD");
+    check(smallGenealogy.exists(handle), "Handle survives unrelated removal.");
+    checkSameSet(smallGenealogy.get_parents(handle),
+            std::vector<std::string>{"AB"}, "Handle sees updated parents.");
+    checkFalse(smallGenealogy.exists(leaf), "Handle to removed virus is stale.");
+    checkExceptionThrown<VirusNotFound>(
+            [&smallGenealogy, &leaf] { smallGenealogy[leaf]; },
+            "Can't query through a stale handle.");
+
+    smallGenealogy.create("F", "A");
+    checkFalse(smallGenealogy.exists(leaf),
+            "Stale handle doesn't refer to a recreated virus.");
+
+    SmallGenealogy otherGenealogy;
+    checkFalse(otherGenealogy.exists(handle),
+            "Handle doesn't exist in another genealogy.");
+    checkExceptionThrown<VirusNotFound>(
+            [&otherGenealogy, &handle] { otherGenealogy[handle]; },
+            "Can't query another genealogy through a handle.");
+    checkExceptionThrown<VirusNotFound>(
+            [&otherGenealogy, &handle] { otherGenealogy.get_parents(handle); },
+            "Can't get parents from another genealogy through a handle.");
+
+    // A genealogy constructed where an old one lived mustn't accept its
+    // handles.
+    std::aligned_storage<sizeof(SmallGenealogy),
+            alignof(SmallGenealogy)>::type storage;
+    SmallGenealogy *reused = new (&storage) SmallGenealogy();
+    auto old = reused->find_handle("A");
+    reused->~SmallGenealogy();
+    reused = new (&storage) SmallGenealogy();
+    checkFalse(reused->exists(old),
+            "Handle doesn't exist in a genealogy at the same address.");
+    checkExceptionThrown<VirusNotFound>(
+            [reused, &old] { (*reused)[old]; },
+            "Can't query a genealogy at the same address through a handle.");
+    reused->~SmallGenealogy();
+}
+
 int main() {
     testGetStemId();
     testExists();
@@ -244,4 +446,10 @@ int main() {
     testCreate();
     testSubscript();
     testRemove();
+    testChildAndParentCount();
+    testIteration();
+    testMetrics();
+    testMetricsCacheOnChain();
+    testMetricsOnLongChain();
+    testHandles();
 }